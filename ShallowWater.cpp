@@ -1,4 +1,5 @@
 #include "ShallowWater.h"
+#include "Telemetry.h"
 
 #include <string>
 #include <iostream>
@@ -6,6 +7,16 @@
 #include <fstream> 
 #include <cblas.h>
 #include <cstdlib>
+#include <algorithm>
+#include <vector>
+#include <cstring>
+#include <cstdint>
+#include <zlib.h>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include <omp.h>
 
@@ -24,6 +35,7 @@ std::cout << "Class destroyed" << std::endl;
 delete[] h;
 delete[] u;
 delete[] v;
+delete[] b;
 }   // Custom destructor definition
 
 // Method definition
@@ -36,64 +48,205 @@ void ShallowWater::SetInitialCondition(){// ARRAY OF POINTER TO POINTER WILL BE
     u = new double[Nx*Ny];
     v = new double[Nx*Ny];
     
-    for (int i = 0; i<Nx*Ny; i++){
-        u[i] =  0;
-        v[i] =  0;
-    }
-    // Populate 2 dimensional array depending on Index of initial condition
+    // Populate 2 dimensional array depending on Index of initial condition.
+    // Columns are filled in parallel with a static schedule, which hands each
+    // thread the same contiguous block of columns as TimeIntegrate, so pages
+    // are first touched by the thread that later works on them. Exponentials
+    // that only depend on one direction are hoisted out of the inner loop.
     
     switch (ic){
         case 1:
+            #pragma omp parallel for schedule(static)
             for (int i = 0; i<Nx; i++){
+                const double hx = (double) (10 + std::exp(-(i*dx-Nx/2.)*(i*dx-Nx/2.)/(Nx/4.)));
+                #pragma omp simd
                 for (int j = 0; j<Ny; j++){
-//                    g[i][j] = (double) (std::exp(-(i*dx-50)*(i*dx-50)/25));
-//                    g[i][j] = i+1 + (j+1)*10;
-                    h[i*Ny + j] = (double) (10 + std::exp(-(i*dx-Nx/2.)*(i*dx-Nx/2.)/(Nx/4.)));
+                    u[i*Ny + j] = 0;
+                    v[i*Ny + j] = 0;
+                    h[i*Ny + j] = hx;
                 }
             }
             break;
-        case 2:
+        case 2:{
+            double* hy = new double[Ny];
+            for (int j = 0; j<Ny; j++){
+                hy[j] = (double) (10+ std::exp(-(j*dy-Ny/2.)*(j*dy-Ny/2.)/(Nx/4.)));
+            }
+            #pragma omp parallel for schedule(static)
             for (int i = 0; i<Nx; i++){
+                #pragma omp simd
                 for (int j = 0; j<Ny; j++){
-//                    h[i*Nx + j] = (double) ( std::exp(-(j*dy-50)*(j*dy-50)/25));
-                    h[i*Ny + j] = (double) (10+ std::exp(-(j*dy-Ny/2.)*(j*dy-Ny/2.)/(Nx/4.)));
+                    u[i*Ny + j] = 0;
+                    v[i*Ny + j] = 0;
+                    h[i*Ny + j] = hy[j];
                 }
             }
+            delete[] hy;
             break;
+        }
         case 3: 
+            #pragma omp parallel for schedule(static)
             for (int i = 0; i<Nx; i++){
+                const double rx = (i*dx-50)*(i*dx-50);
                 for (int j = 0; j<Ny; j++){
-                    h[i*Ny + j] = (double) (10 + std::exp(-((i*dx-50)*(i*dx-50) + (j*dy-50)*(j*dy-50))/25.));
+                    u[i*Ny + j] = 0;
+                    v[i*Ny + j] = 0;
+                    h[i*Ny + j] = (double) (10 + std::exp(-(rx + (j*dy-50)*(j*dy-50))/25.));
                 }
             }
             break;
         case 4: 
+            #pragma omp parallel for schedule(static)
             for (int i = 0; i<Nx; i++){
+                const double rx1 = (i*dx-25)*(i*dx-25);
+                const double rx2 = (i*dx-75)*(i*dx-75);
                 for (int j = 0; j<Ny; j++){
-                    h[i*Ny + j] = (double) (10 + std::exp(-((i*dx-25)*(i*dx-25) + (j*dy-25)*(j*dy-25))/25.) + std::exp(-((i*dx-75)*(i*dx-75) + (j*dy-75)*(j*dy-75))/25.));
+                    u[i*Ny + j] = 0;
+                    v[i*Ny + j] = 0;
+                    h[i*Ny + j] = (double) (10 + std::exp(-(rx1 + (j*dy-25)*(j*dy-25))/25.) + std::exp(-(rx2 + (j*dy-75)*(j*dy-75))/25.));
+                }
+            }
+            break;
+        default:
+            #pragma omp parallel for schedule(static)
+            for (int i = 0; i<Nx; i++){
+                for (int j = 0; j<Ny; j++){
+                    u[i*Ny + j] = 0;
+                    v[i*Ny + j] = 0;
+                    h[i*Ny + j] = 0;
                 }
             }
             break;
     }
 }
 
+bool ShallowWater::LoadInitialCondition(const std::string& filename){
+    // Memory-map a binary output file (see OutputOptions) and copy its fields
+    // straight from the mapping into the solver arrays.
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0){
+        std::cout << "Could not open initial condition file " << filename << "." << std::endl;
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < 80){
+        std::cout << "Initial condition file " << filename << " is too small." << std::endl;
+        close(fd);
+        return false;
+    }
+    const size_t fileSize = st.st_size;
+    void* map = mmap(nullptr, fileSize, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED){
+        std::cout << "Could not map initial condition file " << filename << "." << std::endl;
+        return false;
+    }
+    madvise(map, fileSize, MADV_WILLNEED);
+    const char* file = (const char*) map;
+    
+    // Header, same layout as WriteBinary
+    int32_t ints[5];
+    int32_t nfields, codec, chunking[2];
+    double hError;
+    char fields[9] = {0};
+    std::memcpy(ints, file + 4, sizeof(ints));
+    std::memcpy(&nfields, file + 40, sizeof(nfields));
+    std::memcpy(fields, file + 44, 8);
+    std::memcpy(&codec, file + 52, sizeof(codec));
+    std::memcpy(&hError, file + 56, sizeof(hError));
+    std::memcpy(chunking, file + 72, sizeof(chunking));
+    
+    const size_t dim = (size_t) Nx*Ny;
+    size_t dataOffset = 0;
+    std::string error;
+    if (std::memcmp(file, "SWO1", 4) != 0){
+        error = "not a binary output file";
+    }
+    else if (ints[0] != Nx || ints[1] != Ny){
+        error = "grid is " + std::to_string(ints[0]) + "x" + std::to_string(ints[1]) + ", expected " + std::to_string(Nx) + "x" + std::to_string(Ny);
+    }
+    else if (ints[2] != 0 || ints[3] != 0 || ints[4] != 1 || codec != 0 || hError != 0.){
+        error = "file must be full grid, stride 1, uncompressed and lossless";
+    }
+    else if (nfields < 1 || nfields > 8 || std::string(fields).find('h') == std::string::npos){
+        error = "file does not contain h";
+    }
+    else if (chunking[0] < 1 || chunking[1] != ((int64_t) Nx + chunking[0] - 1)/chunking[0]){
+        error = "inconsistent chunking";
+    }
+    else{
+        // Every entry of the size table must be the raw size of its chunk. The
+        // table has at most 8*Nx entries, so none of the sizes below can wrap.
+        const int chunkCols = chunking[0];
+        const int nchunks = chunking[1];
+        const size_t tableSize = (size_t) 8*nfields*nchunks;
+        dataOffset = 80 + tableSize;
+        if (fileSize < dataOffset){
+            error = "file is truncated";
+        }
+        for (int k = 0; error.empty() && k < nfields*nchunks; k++){
+            const int c0 = (k%nchunks)*chunkCols;
+            const uint64_t expected = (uint64_t) std::min(chunkCols, Nx - c0)*Ny*sizeof(double);
+            uint64_t size;
+            std::memcpy(&size, file + 80 + (size_t) 8*k, sizeof(size));
+            if (size != expected){
+                error = "chunk size table does not match an uncompressed file";
+            }
+        }
+        if (error.empty() && (fileSize - dataOffset)/sizeof(double)/nfields < dim){
+            error = "file is truncated";
+        }
+    }
+    if (!error.empty()){
+        std::cout << "Invalid initial condition file " << filename << ": " << error << "." << std::endl;
+        munmap(map, fileSize);
+        return false;
+    }
+    
+    // With codec 0 the chunks of a field are contiguous, so each field is a
+    // single Nx*Ny column-major block.
+    const double* src[4] = {nullptr, nullptr, nullptr, nullptr}; // u, v, h, b
+    for (int f = 0; f < nfields; f++){
+        const double* block = (const double*) (file + dataOffset) + f*dim;
+        switch (fields[f]){
+            case 'u': src[0] = block; break;
+            case 'v': src[1] = block; break;
+            case 'h': src[2] = block; break;
+            case 'b': src[3] = block; break;
+        }
+    }
+    
+    h = new double[dim];
+    u = new double[dim];
+    v = new double[dim];
+    if (src[3]) {b = new double[dim];}
+    
+    // Same static column partition as SetInitialCondition for first touch
+    #pragma omp parallel for schedule(static)
+    for (int i = 0; i<Nx; i++){
+        const size_t col = (size_t) i*Ny;
+        std::memcpy(h + col, src[2] + col, Ny*sizeof(double));
+        if (src[0]) {std::memcpy(u + col, src[0] + col, Ny*sizeof(double));}
+        else {std::memset(u + col, 0, Ny*sizeof(double));}
+        if (src[1]) {std::memcpy(v + col, src[1] + col, Ny*sizeof(double));}
+        else {std::memset(v + col, 0, Ny*sizeof(double));}
+        if (src[3]) {std::memcpy(b + col, src[3] + col, Ny*sizeof(double));}
+    }
+    
+    munmap(map, fileSize);
+    return true;
+}
+
 
 void ShallowWater::TimeIntegrate(){
-    std::cout << std::setprecision(16) << std::fixed;
-    std::string str;
-    
     int threadid;
     int NumThreads;
     
     int remainder_col =0;
-    int remainder_row = 0;
-    int local_col, local_row;
+    int local_col;
     
     int* cumsum_col = nullptr;
-    int* cumsum_row = nullptr;
-    
     int* additional_col = nullptr;
-    int* additional_row = nullptr;
     
     int dim = Nx*Ny;
     
@@ -120,6 +273,12 @@ void ShallowWater::TimeIntegrate(){
     double coeffs[6] = {-0.016667, 0.15, -0.75, 0.75, -0.15, 0.016667};
     double RKcoeffs[4] = {dt/6, dt/3, dt/3, dt/6};
     double kcoeffs[3] = {dt/2, dt/2, dt};
+    
+    // Shared accumulators for the optional diagnostics reduction
+    double diag_mass = 0.;
+    double diag_hmax = -HUGE_VAL;
+    
+    if (telemetry) {telemetry->Start(std::lround(T/dt));}
 
     // Open branch of threads
     #pragma omp parallel default(shared) private(threadid) 
@@ -128,7 +287,7 @@ void ShallowWater::TimeIntegrate(){
         
         // Perform calculatrions to divide computations betwwen threads.
         // Instead of splitting up the nodes evenly betwwen threads, 
-        // problem will be splitted into columns and rows. Even though the
+        // problem will be splitted into strips of columns. Even though the
         // approach proposed will cause work to be splitted unevenly betwwen 
         // threads, other benefits can be seen by using cache firendly operations
         if (threadid == 0){
@@ -137,9 +296,6 @@ void ShallowWater::TimeIntegrate(){
             remainder_col = Nx%NumThreads;
             local_col = (Nx - remainder_col)/NumThreads;
             
-            remainder_row = Ny%NumThreads;
-            local_row = (Ny - remainder_row)/NumThreads;
-            
             std::cout << "\t" << "Number of threads:\t" <<"\t" << NumThreads << "\n" << std::endl;
             
             // Populating initial pointer shifting array due to reaminder of columns
@@ -158,33 +314,21 @@ void ShallowWater::TimeIntegrate(){
                     cumsum_col[i] = cumsum_col[i-1] + local_col;
                 }
             }
-            
-            // Same for rows
-            cumsum_row = new int[NumThreads];
-            additional_row = new int[NumThreads];
-            for (int i =0; i< NumThreads; i++){
-                cumsum_row[i] = i*local_row;
-                additional_row[i] = 0;
-            }
-            if ( remainder_row != 0) {
-                for (int i = 1 ; i < remainder_row+1; i++){
-                    additional_row[i-1] = 1;
-                    cumsum_row[i] = cumsum_row[i-1] + local_row + 1;
-                }
-                for (int i = remainder_row+1; i<NumThreads; i++){
-                    cumsum_row[i] = cumsum_row[i-1] + local_row;
-                }
-            }
         }
         #pragma omp barrier
         
+        // Column strip of this thread, shared by the derivative and update phases
+        const int col0 = cumsum_col[threadid];
+        const int col1 = col0 + local_col + additional_col[threadid];
+        
         // Start integration loop 
         double t = dt;
+        long step = 0;
         while (t < T + dt/2){
             // Calculate k1 and propagate Snew
-            GetDerivativesParallel(local_row+additional_row[threadid], local_col + additional_col[threadid], u + (cumsum_row[threadid]),u + (cumsum_col[threadid])*Ny,  dudx + (cumsum_row[threadid]), dudy + (cumsum_col[threadid])*Ny, coeffs);
-            GetDerivativesParallel(local_row+additional_row[threadid], local_col + additional_col[threadid], v + (cumsum_row[threadid]),v + (cumsum_col[threadid])*Ny,  dvdx + (cumsum_row[threadid]), dvdy + (cumsum_col[threadid])*Ny, coeffs);
-            GetDerivativesParallel(local_row+additional_row[threadid], local_col + additional_col[threadid], h + (cumsum_row[threadid]),h + (cumsum_col[threadid])*Ny,  dhdx + (cumsum_row[threadid]), dhdy + (cumsum_col[threadid])*Ny, coeffs);
+            GetDerivativesTile(col0, col1, u, dudx, dudy, coeffs);
+            GetDerivativesTile(col0, col1, v, dvdx, dvdy, coeffs);
+            GetDerivativesTile(col0, col1, h, dhdx, dhdy, coeffs);
             
             #pragma omp barrier
             
@@ -206,9 +350,9 @@ void ShallowWater::TimeIntegrate(){
             #pragma omp barrier
             
             // Calculate k2 and propagate Snew
-            GetDerivativesParallel(local_row+additional_row[threadid], local_col + additional_col[threadid], u + (cumsum_row[threadid]),u + (cumsum_col[threadid])*Ny,  dudx + (cumsum_row[threadid]), dudy + (cumsum_col[threadid])*Ny, coeffs);
-            GetDerivativesParallel(local_row+additional_row[threadid], local_col + additional_col[threadid], v + (cumsum_row[threadid]),v + (cumsum_col[threadid])*Ny,  dvdx + (cumsum_row[threadid]), dvdy + (cumsum_col[threadid])*Ny, coeffs);
-            GetDerivativesParallel(local_row+additional_row[threadid], local_col + additional_col[threadid], h + (cumsum_row[threadid]),h + (cumsum_col[threadid])*Ny,  dhdx + (cumsum_row[threadid]), dhdy + (cumsum_col[threadid])*Ny, coeffs);
+            GetDerivativesTile(col0, col1, u, dudx, dudy, coeffs);
+            GetDerivativesTile(col0, col1, v, dvdx, dvdy, coeffs);
+            GetDerivativesTile(col0, col1, h, dhdx, dhdy, coeffs);
             
             #pragma omp barrier
             
@@ -232,9 +376,9 @@ void ShallowWater::TimeIntegrate(){
             #pragma omp barrier
             
             // Calculate k3 and propagate Snew
-            GetDerivativesParallel(local_row+additional_row[threadid], local_col + additional_col[threadid], u + (cumsum_row[threadid]),u + (cumsum_col[threadid])*Ny,  dudx + (cumsum_row[threadid]), dudy + (cumsum_col[threadid])*Ny, coeffs);
-            GetDerivativesParallel(local_row+additional_row[threadid], local_col + additional_col[threadid], v + (cumsum_row[threadid]),v + (cumsum_col[threadid])*Ny,  dvdx + (cumsum_row[threadid]), dvdy + (cumsum_col[threadid])*Ny, coeffs);
-            GetDerivativesParallel(local_row+additional_row[threadid], local_col + additional_col[threadid], h + (cumsum_row[threadid]),h + (cumsum_col[threadid])*Ny,  dhdx + (cumsum_row[threadid]), dhdy + (cumsum_col[threadid])*Ny, coeffs);
+            GetDerivativesTile(col0, col1, u, dudx, dudy, coeffs);
+            GetDerivativesTile(col0, col1, v, dvdx, dvdy, coeffs);
+            GetDerivativesTile(col0, col1, h, dhdx, dhdy, coeffs);
             
             #pragma omp barrier
             
@@ -258,9 +402,9 @@ void ShallowWater::TimeIntegrate(){
             #pragma omp barrier
             
             // Calculate k3 and propagate Snew
-            GetDerivativesParallel(local_row+additional_row[threadid], local_col + additional_col[threadid], u + (cumsum_row[threadid]),u + (cumsum_col[threadid])*Ny,  dudx + (cumsum_row[threadid]), dudy + (cumsum_col[threadid])*Ny, coeffs);
-            GetDerivativesParallel(local_row+additional_row[threadid], local_col + additional_col[threadid], v + (cumsum_row[threadid]),v + (cumsum_col[threadid])*Ny,  dvdx + (cumsum_row[threadid]), dvdy + (cumsum_col[threadid])*Ny, coeffs);
-            GetDerivativesParallel(local_row+additional_row[threadid], local_col + additional_col[threadid], h + (cumsum_row[threadid]),h + (cumsum_col[threadid])*Ny,  dhdx + (cumsum_row[threadid]), dhdy + (cumsum_col[threadid])*Ny, coeffs);
+            GetDerivativesTile(col0, col1, u, dudx, dudy, coeffs);
+            GetDerivativesTile(col0, col1, v, dvdx, dvdy, coeffs);
+            GetDerivativesTile(col0, col1, h, dhdx, dhdy, coeffs);
             
             #pragma omp barrier
             
@@ -275,20 +419,33 @@ void ShallowWater::TimeIntegrate(){
             }
             #pragma omp barrier
             
-//            #pragma omp critical
-//            if (threadid == 0){
-//                std::cout << std::string(str.length(),'\b');
-//                str = "Time: " + std::to_string(t) + ". " + std::to_string((int) ((t)/dt)) + " time steps done out of " + std::to_string((int) (T/dt)) + ".";
-//                std::cout << str;
-//            }
+            // Progress is a couple of relaxed stores; the reporter thread does the I/O
+            step++;
+            bool diagDue = telemetry && telemetry->DiagnosticsDue(step);
+            if (diagDue){
+                // The static schedule hands every thread the same column strip as cumsum_col
+                #pragma omp for schedule(static) reduction(+:diag_mass) reduction(max:diag_hmax)
+                for (int ix = 0; ix < Nx; ix++){
+                    Diagnostics(h, 1, ix, ix+1, diag_mass, diag_hmax);
+                }
+            }
+            if (threadid == 0 && telemetry){
+                telemetry->Publish(step, t);
+                if (diagDue){
+                    telemetry->PublishDiagnostics(diag_mass*dx*dy, diag_hmax);
+                    // Not touched again by any thread before the next due step
+                    diag_mass = 0.;
+                    diag_hmax = -HUGE_VAL;
+                }
+            }
             t+=dt;
         }
     }
     
+    if (telemetry) {telemetry->Stop();}
+    
     delete[] cumsum_col;
     delete[] additional_col;
-    delete[] cumsum_row;
-    delete[] additional_row;
             
     delete[] kutemp;
     delete[] kvtemp;
@@ -312,9 +469,218 @@ void ShallowWater::TimeIntegrate(){
             
 }
 
-void ShallowWater::TimeIntegrateBLAS(){ 
+void ShallowWater::TimeIntegrateTasks(int ntiles){
+    // Dataflow variant of TimeIntegrate. The grid is split into column tiles and
+    // every RK stage becomes, per tile, a derivative task (reads the state of the
+    // tile and its two neighbours) and an update task (writes the state of the
+    // tile). OpenMP task dependencies replace the global barriers, so a tile can
+    // start stage k+1 as soon as its neighbours have finished stage k.
+    int dim = Nx*Ny;
+    
+    double* ku = new double[dim];
+    double* kv = new double[dim];
+    double* kh = new double[dim];
+    
+    double* kutemp = new double[dim];
+    double* kvtemp = new double[dim];
+    double* khtemp = new double[dim];    
+    
+    double* unew = new double[dim];
+    double* vnew = new double[dim];
+    double* hnew = new double[dim];
+    
+    double* dhdx = new double[dim];
+    double* dudx = new double[dim];
+    double* dvdx = new double[dim];
+
+    double* dhdy = new double[dim];
+    double* dudy = new double[dim];
+    double* dvdy = new double[dim];
+    
+    double coeffs[6] = {-0.016667, 0.15, -0.75, 0.75, -0.15, 0.016667};
+    double RKcoeffs[4] = {dt/6, dt/3, dt/3, dt/6};
+    double kcoeffs[3] = {dt/2, dt/2, dt};
+    
+    // The x-stencil reaches 3 columns either side, so tiles of at least 4
+    // columns only ever depend on their immediate (periodic) neighbours.
+    if (ntiles <= 0) {ntiles = 4*omp_get_max_threads();}
+    ntiles = std::max(1, std::min(ntiles, Nx/4));
+    
+    int* tile_col = new int[ntiles+1];
+    for (int i = 0; i <= ntiles; i++){
+        tile_col[i] = (int) ((long) i*Nx/ntiles);
+    }
+    
+    // Dependency tokens, one per tile, for the state (u,v,h) and the derivatives
+    char* state_dep = new char[ntiles];
+    char* deriv_dep = new char[ntiles];
+    
+    std::cout << "\t" << "Number of threads:\t" <<"\t" << omp_get_max_threads() << std::endl;
+    std::cout << "\t" << "Number of tiles:\t" <<"\t" << ntiles << "\n" << std::endl;
+    
+    // Stage update for nodes [n0, n1), identical to the per-node loops of TimeIntegrate
+    auto update = [&](int stage, int n0, int n1){
+        if (stage == 0){
+            for (int node = n0; node < n1; node++){
+                ku[node] = -u[node]*dudx[node] - v[node]*dudy[node] - g*dhdx[node];
+                unew[node] = u[node] + RKcoeffs[0] * ku[node];
+                
+                kv[node] =  -u[node]*dvdx[node] - v[node]*dvdy[node] - g*dhdy[node];
+                vnew[node] = v[node] + RKcoeffs[0] * kv[node];
+                
+                kh[node] = -h[node]*dudx[node] - u[node]*dhdx[node] - h[node]*dvdy[node] - v[node]*dhdy[node];
+                hnew[node] = h[node] + RKcoeffs[0] * kh[node];
+                
+                u[node] += kcoeffs[0]*ku[node];
+                v[node] += kcoeffs[0]*kv[node];
+                h[node] += kcoeffs[0]*kh[node];
+            }
+        }
+        else if (stage < 3){
+            for (int node = n0; node < n1; node++){
+                kutemp[node] = ku[node];
+                ku[node] = -u[node]*dudx[node] - v[node]*dudy[node] - g*dhdx[node];
+                unew[node] += RKcoeffs[stage] * ku[node];
+                
+                kvtemp[node] = kv[node];
+                kv[node] =  -u[node]*dvdx[node] - v[node]*dvdy[node] - g*dhdy[node];
+                vnew[node] += RKcoeffs[stage] * kv[node];
+                
+                khtemp[node] = kh[node];
+                kh[node] = -h[node]*dudx[node] - u[node]*dhdx[node] - h[node]*dvdy[node] - v[node]*dhdy[node];
+                hnew[node] += RKcoeffs[stage] * kh[node];
+                
+                u[node] += kcoeffs[stage]*ku[node] - kcoeffs[stage-1]*kutemp[node];
+                v[node] += kcoeffs[stage]*kv[node] - kcoeffs[stage-1]*kvtemp[node];
+                h[node] += kcoeffs[stage]*kh[node] - kcoeffs[stage-1]*khtemp[node];
+            }
+        }
+        else{
+            for (int node = n0; node < n1; node++){
+                ku[node] = -u[node]*dudx[node] - v[node]*dudy[node] - g*dhdx[node];
+                kv[node] =  -u[node]*dvdx[node] - v[node]*dvdy[node] - g*dhdy[node];
+                kh[node] = -h[node]*dudx[node] - u[node]*dhdx[node] - h[node]*dvdy[node] - v[node]*dhdy[node];
+                
+                u[node] = unew[node] + RKcoeffs[3] * ku[node];
+                v[node] = vnew[node] + RKcoeffs[3] * kv[node];
+                h[node] = hnew[node] + RKcoeffs[3] * kh[node];
+            }
+        }
+    };
     
-    std::string str;
+    // Completion tokens of the final stage, one set per step in flight. The task
+    // generator waits on them to stay at most 'lookahead' steps ahead; without
+    // this the runtime tracks the dependencies of the whole run at once and the
+    // cost per task keeps growing.
+    const int lookahead = 2;
+    char* done_dep = new char[lookahead*ntiles];
+    
+    // Per-tile partial diagnostics, indexed like done_dep
+    double* tile_mass = new double[lookahead*ntiles];
+    double* tile_hmax = new double[lookahead*ntiles];
+    
+    if (telemetry) {telemetry->Start(std::lround(T/dt));}
+    
+    #pragma omp parallel default(shared)
+    #pragma omp single
+    {
+        // Start integration loop 
+        double t = dt;
+        long step = 0;
+        while (t < T + dt/2){
+            step++;
+            char* done_step = done_dep + (step%lookahead)*ntiles;
+            double* mass_step = tile_mass + (step%lookahead)*ntiles;
+            double* hmax_step = tile_hmax + (step%lookahead)*ntiles;
+            bool diagDue = telemetry && telemetry->DiagnosticsDue(step);
+            for (int tile = 0; tile < ntiles; tile++){
+                #pragma omp taskwait depend(in: done_step[tile])
+            }
+            for (int stage = 0; stage < 4; stage++){
+                // All derivative tasks of a stage are created before its update
+                // tasks, so an update waits for its neighbours to finish reading
+                // (write-after-read) rather than the other way round.
+                for (int tile = 0; tile < ntiles; tile++){
+                    int left = (tile + ntiles - 1)%ntiles;
+                    int right = (tile + 1)%ntiles;
+                    int c0 = tile_col[tile];
+                    int cols = tile_col[tile+1] - c0;
+                    
+                    #pragma omp task firstprivate(c0, cols) depend(in: state_dep[left], state_dep[tile], state_dep[right]) depend(out: deriv_dep[tile])
+                    {
+                        GetDerivativesTile(c0, c0 + cols, u, dudx, dudy, coeffs);
+                        GetDerivativesTile(c0, c0 + cols, v, dvdx, dvdy, coeffs);
+                        GetDerivativesTile(c0, c0 + cols, h, dhdx, dhdy, coeffs);
+                    }
+                }
+                for (int tile = 0; tile < ntiles; tile++){
+                    int c0 = tile_col[tile];
+                    int cols = tile_col[tile+1] - c0;
+                    char* done_tile = (stage == 3) ? done_step + tile : state_dep + tile;
+                    
+                    #pragma omp task firstprivate(stage, tile, c0, cols, step, t, diagDue) depend(in: deriv_dep[tile]) depend(inout: state_dep[tile], *done_tile)
+                    {
+                        update(stage, c0*Ny, (c0 + cols)*Ny);
+                        // Tile 0 finishing its last stage stands in for the step being done
+                        if (stage == 3 && tile == 0 && telemetry) {telemetry->Publish(step, t);}
+                        if (stage == 3 && diagDue){
+                            mass_step[tile] = 0.;
+                            hmax_step[tile] = -HUGE_VAL;
+                            Diagnostics(h, 1, c0, c0 + cols, mass_step[tile], hmax_step[tile]);
+                        }
+                    }
+                }
+            }
+            
+            // Combine the tile partials once every tile has finished this step.
+            // The next writers of these tokens (step + lookahead) wait for it.
+            if (diagDue){
+                #pragma omp task firstprivate(mass_step, hmax_step) depend(iterator(it = 0:ntiles), in: done_step[it])
+                {
+                    double mass = 0.;
+                    double hmax = -HUGE_VAL;
+                    for (int tile = 0; tile < ntiles; tile++){
+                        mass += mass_step[tile];
+                        hmax = std::max(hmax, hmax_step[tile]);
+                    }
+                    telemetry->PublishDiagnostics(mass*dx*dy, hmax);
+                }
+            }
+            t+=dt;
+        }
+    }
+    
+    if (telemetry) {telemetry->Stop();}
+    
+    delete[] tile_col;
+    delete[] state_dep;
+    delete[] deriv_dep;
+    delete[] done_dep;
+    delete[] tile_mass;
+    delete[] tile_hmax;
+            
+    delete[] kutemp;
+    delete[] kvtemp;
+    delete[] khtemp;
+    
+    delete[] unew;
+    delete[] vnew;
+    delete[] hnew;
+    
+    delete[] dhdx;
+    delete[] dudx;
+    delete[] dvdx;
+
+    delete[] dhdy;
+    delete[] dudy;
+    delete[] dvdy;
+
+    delete[] ku;
+    delete[] kv;
+    delete[] kh;
+}
+
+void ShallowWater::TimeIntegrateBLAS(){ 
     
     // Populate Differentiation matrix (Only Required by BLAS implementation)
     int ldsy = 3*Ny;
@@ -341,8 +707,11 @@ void ShallowWater::TimeIntegrateBLAS(){
     // Construct state vector S = [u, v, h]^T. [u,v,h] for all nodes stack on yop of each other in a column major way
     ShallowWater::ConstructSVector(S);
     
+    if (telemetry) {telemetry->Start(std::lround(T/dt));}
+    
     // Start integration loop 
     double t = dt;
+    long step = 0;
     while (t < T + dt/2){
         
         // Calculate k1 and propagate Snew
@@ -383,12 +752,20 @@ void ShallowWater::TimeIntegrateBLAS(){
         }
         
 
-        std::cout << std::string(str.length(),'\b');
-        str = "Time: " + std::to_string(t) + ". " + std::to_string((int) ((t)/dt)) + " time steps done out of " + std::to_string((int) (T/dt)) + ".";
-        std::cout << str;
+        step++;
+        if (telemetry){
+            telemetry->Publish(step, t);
+            if (telemetry->DiagnosticsDue(step)){
+                double mass = 0., hmax = -HUGE_VAL;
+                Diagnostics(S + 2, 3, 0, Nx, mass, hmax);
+                telemetry->PublishDiagnostics(mass*dx*dy, hmax);
+            }
+        }
         t += dt;
     }  
     
+    if (telemetry) {telemetry->Stop();}
+    
     for (int i = 0; i<dimS; i+=3){
         u[i/3] = S[i];
         v[i/3] = S[i+1];
@@ -409,36 +786,13 @@ void ShallowWater::TimeIntegrateBLAS(){
 
 
 
-void ShallowWater::GetDerivativesParallel(const int& rows, const int& cols, const double* varx, const double* vary,  double* dvardx, double* dvardy, const double* coeffs){
-     // Calculate derivatives in direction x and y (ASSUME SQUARE)
-    int ldy = Ny;    
-    int ldy2 = 2*ldy;
-    int ldy3 = 3*ldy;
-    int ldx = Nx*ldy;
-    // X - DERIVATIVES
-    for (int iy = 0; iy < rows; iy++){
-        // Boundary points for ix <3 and ix > Nx-3   
-        // Left most points
-        dvardx[iy] = coeffs[0]*varx[iy + ldx - (ldy3 + ldy)] + coeffs[1]*varx[iy + ldx - ldy3] + coeffs[2]*varx[iy + ldx - ldy2] + coeffs[3]*varx[iy + ldy] + coeffs[4]*varx[iy + ldy2] + coeffs[5]*varx[iy + ldy3];
-        dvardx[iy + ldy] = coeffs[0]*varx[iy + ldx -ldy3] + coeffs[1]*varx[iy + ldx - ldy2] + coeffs[2]*varx[iy] + coeffs[3]*varx[iy +ldy2] + coeffs[4]*varx[iy + ldy3] + coeffs[5]*varx[iy + ldy3 + ldy];
-        dvardx[iy + ldy2] = coeffs[0]*varx[iy +  ldx - ldy2] + coeffs[1]*varx[iy] + coeffs[2]*varx[iy + ldy] + coeffs[3]*varx[iy + ldy3] + coeffs[4]*varx[iy + ldy3 + ldy] + coeffs[5]*varx[iy + ldy3 + ldy2];
-        
-        // Right most points
-        dvardx[iy+ldx-ldy] = coeffs[0]*varx[iy + ldx - (ldy3 + ldy)] + coeffs[1]*varx[iy + ldx - ldy3] + coeffs[2]*varx[iy + ldx - ldy2] + coeffs[3]*varx[iy + ldy] + coeffs[4]*varx[iy + ldy2] + coeffs[5]*varx[iy + ldy3];
-        dvardx[iy+ldx-ldy2] = coeffs[0]*varx[iy + ldx - (ldy3 + ldy2)] + coeffs[1]*varx[iy + ldx - (ldy3 + ldy)] + coeffs[2]*varx[iy + ldx - ldy3] + coeffs[3]*varx[iy] + coeffs[4]*varx[iy + ldy] + coeffs[5]*varx[iy + ldy2];
-        dvardx[iy+ldx-ldy3] = coeffs[0]*varx[iy + ldx - (ldy3 + ldy3)] + coeffs[1]*varx[iy + ldx - (ldy3 + ldy2)] + coeffs[2]*varx[iy + ldx - (ldy3 + ldy)] + coeffs[3]*varx[iy + ldx - ldy2] + coeffs[4]*varx[iy] + coeffs[5]*varx[iy + ldy];
-    
-        // Inner points
-        int counter = ldy3 + iy;
-        for (int ix = 3; ix<Nx-3; ix++){
-            dvardx[counter] = coeffs[0]*varx[counter - ldy3] + coeffs[1]*varx[counter - ldy2] + coeffs[2]*varx[counter - ldy] + coeffs[3]*varx[counter + ldy] + coeffs[4]*varx[counter + ldy2] + coeffs[5]*varx[counter + ldy3];
-            counter += ldy;
-        }
-    }
+void ShallowWater::GetDerivativesYTile(const int& col0, const int& col1, const double* vary, double* dvardy, const double* coeffs){
+    // Y-derivative of columns [col0, col1), periodic in y
+    int ldy = Ny;
         
     // Y - DERIVATVES
     
-    for (int ix = 0; ix < cols; ix++){
+    for (int ix = col0; ix < col1; ix++){
         // Boundary points for iy <3 and iy > Nx-3
         int counter = ldy*ix;
         // Top points
@@ -459,6 +813,42 @@ void ShallowWater::GetDerivativesParallel(const int& rows, const int& cols, cons
     }
 }
 
+void ShallowWater::GetDerivativesTile(const int& col0, const int& col1, const double* var, double* dvardx, double* dvardy, const double* coeffs){
+    // Both derivatives of columns [col0, col1). Shared by the barrier and the
+    // task schedules so they only differ in how the work is scheduled.
+    GetDerivativesXTile(col0, col1, var, dvardx, coeffs);
+    GetDerivativesYTile(col0, col1, var, dvardy, coeffs);
+}
+
+void ShallowWater::GetDerivativesXTile(const int& col0, const int& col1, const double* var, double* dvardx, const double* coeffs){
+    // X-derivative of columns [col0, col1) over all rows. Same stencil and
+    // periodic closure as the y-derivative (period Nx-1 at the boundaries),
+    // but split by columns so a tile only touches its neighbours.
+    int ldy = Ny;
+    int ldy2 = 2*ldy;
+    int ldy3 = 3*ldy;
+    int period = Nx-1;
+    for (int ix = col0; ix < col1; ix++){
+        int counter = ix*ldy;
+        if (ix >= 3 && ix < Nx-3){
+            for (int iy = 0; iy < Ny; iy++){
+                dvardx[counter + iy] = coeffs[0]*var[counter + iy - ldy3] + coeffs[1]*var[counter + iy - ldy2] + coeffs[2]*var[counter + iy - ldy] + coeffs[3]*var[counter + iy + ldy] + coeffs[4]*var[counter + iy + ldy2] + coeffs[5]*var[counter + iy + ldy3];
+            }
+        }
+        else{
+            // Boundary columns wrap around
+            int col[6];
+            int offsets[6] = {-3, -2, -1, 1, 2, 3};
+            for (int k = 0; k < 6; k++){
+                col[k] = (((ix + offsets[k])%period + period)%period)*ldy;
+            }
+            for (int iy = 0; iy < Ny; iy++){
+                dvardx[counter + iy] = coeffs[0]*var[col[0] + iy] + coeffs[1]*var[col[1] + iy] + coeffs[2]*var[col[2] + iy] + coeffs[3]*var[col[3] + iy] + coeffs[4]*var[col[4] + iy] + coeffs[5]*var[col[5] + iy];
+            }
+        }
+    }
+}
+
 void ShallowWater::GetDerivativesBLASV2(const double* S, double* dSdx, double* dSdy, const double* coeffs){
     // Calculate derivatives in direction x and y (ASSUME SQUARE)
     int ldy = 3*Ny;    
@@ -553,6 +943,15 @@ void ShallowWater::EvaluateFuncBlasV3(const int& kla, const int& kua, const int&
 
 
 
+void ShallowWater::Diagnostics(const double* hvar, const int& inc, const int& col0, const int& col1, double& mass, double& hmax){
+    // Accumulate the sum and the peak of h over columns [col0, col1). 'inc' is
+    // the distance between consecutive nodes, 3 for the interleaved BLAS state.
+    for (int i = col0*Ny; i<col1*Ny; i++){
+        mass += hvar[i*inc];
+        hmax = std::max(hmax, hvar[i*inc]);
+    }
+}
+
 void ShallowWater::sayHello(){
 std::cout << "Hello from class 'ShallowWater'!" << std::endl;
 }
@@ -586,18 +985,182 @@ void ShallowWater::ConstructSVector(double* S){
 }
 
 void ShallowWater::WriteFile(){
+    WriteFile(OutputOptions());
+}
+
+void ShallowWater::WriteFile(const OutputOptions& opts){
+    // Clamp region of interest to the grid
+    int ix0 = std::max(opts.roi[0], 0);
+    int iy0 = std::max(opts.roi[1], 0);
+    int ix1 = (opts.roi[2] < 0) ? Nx : std::min(opts.roi[2], Nx);
+    int iy1 = (opts.roi[3] < 0) ? Ny : std::min(opts.roi[3], Ny);
+    if (ix1 <= ix0 || iy1 <= iy0 || opts.stride < 1){ // Backstop, main rejects these before the run
+        std::cout << "\n\nEmpty output region, nothing written." << std::endl;
+        return;
+    }
+    
+    if (opts.binary){
+        WriteBinary(opts, ix0, iy0, ix1, iy1);
+    }
+    else{
+        WriteText(opts, ix0, iy0, ix1, iy1);
+    }
+    std::cout << "\n\nWriting output to file." << std::endl;
+}
+
+void ShallowWater::WriteText(const OutputOptions& opts, int ix0, int iy0, int ix1, int iy1){
     std::ofstream myfile;
-    myfile.open("Output.txt");
-    for (int iy = 0; iy< Ny; iy++){
-        for (int ix = 0; ix<Nx; ix++){
-            myfile << ix*dx << "\t" << iy*dy << "\t" << u[iy+ix*Ny] << "\t" << v[iy+ix*Ny] << "\t" << h[iy+ix*Ny] << "\n"; 
+    myfile.open(opts.filename);
+    for (int iy = iy0; iy< iy1; iy+=opts.stride){
+        for (int ix = ix0; ix<ix1; ix+=opts.stride){
+            const char* sep = "";
+            for (char f : opts.fields){
+                myfile << sep;
+                switch (f){
+                    case 'x': myfile << ix*dx; break;
+                    case 'y': myfile << iy*dy; break;
+                    case 'u': myfile << u[iy+ix*Ny]; break;
+                    case 'v': myfile << v[iy+ix*Ny]; break;
+                    case 'h': myfile << h[iy+ix*Ny]; break;
+                }
+                sep = "\t";
+            }
+            myfile << "\n"; 
         }
     }
-    std::cout << "\n\nWriting output to file." << std::endl;
     myfile.close();
+}
+
+// Transpose element bytes so that equal-significance bytes are contiguous,
+// which makes smooth fields far more compressible.
+static void ByteShuffle(const unsigned char* in, unsigned char* out, size_t n, size_t size){
+    for (size_t b = 0; b < size; b++){
+        for (size_t i = 0; i < n; i++){
+            out[b*n + i] = in[i*size + b];
+        }
+    }
+}
+
+void ShallowWater::WriteBinary(const OutputOptions& opts, int ix0, int iy0, int ix1, int iy1){
+    const int stride = opts.stride;
+    const int nxo = (ix1 - ix0 + stride - 1)/stride;
+    const int nyo = (iy1 - iy0 + stride - 1)/stride;
+    
+    // Coordinates are implied by the header, only keep solution fields
+    std::string fields;
+    for (char f : opts.fields){
+        if ((f == 'u' || f == 'v' || f == 'h') && fields.find(f) == std::string::npos) {fields += f;}
+    }
+    const int nfields = fields.size();
     
+    // Error-bounded quantisation of h relative to its minimum in the window
+    double hError = opts.hError;
+    double hOffset = 0.;
+    if (hError > 0. && fields.find('h') != std::string::npos){
+        double hmin = h[iy0 + ix0*Ny];
+        double hmax = hmin;
+        #pragma omp parallel for reduction(min:hmin) reduction(max:hmax)
+        for (int ix = ix0; ix < ix1; ix+=stride){
+            for (int iy = iy0; iy < iy1; iy+=stride){
+                hmin = std::min(hmin, h[iy+ix*Ny]);
+                hmax = std::max(hmax, h[iy+ix*Ny]);
+            }
+        }
+        hOffset = hmin;
+        if ((hmax - hmin)/(2*hError) > 2147483647.){
+            std::cout << "\n\nRange of h too large for requested error bound, writing h losslessly." << std::endl;
+            hError = 0.;
+        }
+    }
+    else{
+        hError = 0.;
+    }
+    
+    // Roughly 1 MB of doubles per chunk
+    const int chunkCols = std::max(1, (1 << 17)/nyo);
+    const int nchunks = (nxo + chunkCols - 1)/chunkCols;
+    const int ntasks = nfields*nchunks;
+    std::vector<std::vector<unsigned char>> chunks(ntasks);
+    bool ok = true;
+    
+    #pragma omp parallel for schedule(dynamic)
+    for (int task = 0; task < ntasks; task++){
+        const char f = fields[task/nchunks];
+        const int c0 = (task%nchunks)*chunkCols;
+        const int c1 = std::min(c0 + chunkCols, nxo);
+        const size_t n = (size_t) (c1 - c0)*nyo;
+        const double* var = (f == 'u') ? u : (f == 'v') ? v : h;
+        const bool quantise = (f == 'h' && hError > 0.);
+        const size_t size = quantise ? sizeof(int32_t) : sizeof(double);
+        
+        // Gather the strided window into a contiguous buffer
+        std::vector<unsigned char> raw(n*size);
+        size_t k = 0;
+        for (int c = c0; c < c1; c++){
+            const double* col = var + (ix0 + c*stride)*Ny;
+            for (int iy = iy0; iy < iy1; iy+=stride, k++){
+                if (quantise){
+                    int32_t q = (int32_t) std::lround((col[iy] - hOffset)/(2*hError));
+                    std::memcpy(&raw[k*size], &q, size);
+                }
+                else{
+                    std::memcpy(&raw[k*size], &col[iy], size);
+                }
+            }
+        }
+        
+        if (opts.codec == 0){
+            chunks[task].swap(raw);
+            continue;
+        }
+        
+        std::vector<unsigned char> shuffled(raw.size());
+        ByteShuffle(raw.data(), shuffled.data(), n, size);
+        uLongf len = compressBound(shuffled.size());
+        chunks[task].resize(len);
+        if (compress2(chunks[task].data(), &len, shuffled.data(), shuffled.size(), Z_BEST_SPEED) != Z_OK){
+            #pragma omp atomic write
+            ok = false;
+        }
+        chunks[task].resize(len);
+    }
+    
+    if (!ok){
+        std::cout << "\n\nCompression failed, output not written." << std::endl;
+        return;
+    }
+    
+    // Header, chunk size table, then chunk data
+    std::ofstream myfile(opts.filename, std::ios::binary);
+    int32_t ints[5] = {nxo, nyo, ix0, iy0, stride};
+    double spacing[2] = {dx, dy};
+    char fieldNames[8] = {0};
+    fields.copy(fieldNames, sizeof(fieldNames) - 1);
+    int32_t nf = nfields;
+    int32_t codec = opts.codec;
+    int32_t chunking[2] = {chunkCols, nchunks};
+    
+    myfile.write("SWO1", 4);
+    myfile.write((const char*) ints, sizeof(ints));
+    myfile.write((const char*) spacing, sizeof(spacing));
+    myfile.write((const char*) &nf, sizeof(nf));
+    myfile.write(fieldNames, sizeof(fieldNames));
+    myfile.write((const char*) &codec, sizeof(codec));
+    myfile.write((const char*) &hError, sizeof(hError));
+    myfile.write((const char*) &hOffset, sizeof(hOffset));
+    myfile.write((const char*) chunking, sizeof(chunking));
+    for (int task = 0; task < ntasks; task++){
+        uint64_t len = chunks[task].size();
+        myfile.write((const char*) &len, sizeof(len));
+    }
+    for (int task = 0; task < ntasks; task++){
+        myfile.write((const char*) chunks[task].data(), chunks[task].size());
+    }
+    myfile.close();
 }
 
+void ShallowWater::setTelemetry(Telemetry* tel){ telemetry = tel;}
+
 // 'Getter' function definition
 double ShallowWater::getTimeStep(){ return dt;}
 double ShallowWater::getIntegrationTime(){ return T;}
@@ -608,4 +1171,5 @@ double ShallowWater::getdx(){ return dx;}
 double ShallowWater::getdy(){return dy;}
 double* ShallowWater::geth(){return h;}
 double* ShallowWater::getu(){return u;}
-double* ShallowWater::getv(){return v;}
\ No newline at end of file
+double* ShallowWater::getv(){return v;}
+double* ShallowWater::getb(){return b;}
\ No newline at end of file
@@ -1,9 +1,37 @@
 #include <iostream>
 #include <cmath>
+#include <string>
 
 #ifndef SHALLOWWATER_H
 #define SHALLOWWATER_H
 
+class Telemetry;
+
+// Output selection. Fields are any of 'x','y','u','v','h'; the region of
+// interest is given in grid indices [ix0, ix1) x [iy0, iy1), -1 meaning the
+// full extent, and is subsampled every 'stride' points in both directions.
+//
+// Binary files ("SWO1") omit x and y (recoverable from the header) and store,
+// for each selected field, the window in column-major order split into chunks
+// of 'chunkCols' output columns. Each chunk is compressed independently.
+//   char[4] magic, int32 nx, ny, ix0, iy0, stride, double dx, dy,
+//   int32 nfields, char[8] fields, int32 codec, double hError, double hOffset,
+//   int32 chunkCols, int32 nchunks, uint64 size[nfields*nchunks], chunk data
+// codec 0 is raw, codec 1 is byte-shuffle + zlib. When hError > 0, h is stored
+// as int32 q with h = hOffset + 2*hError*q, so |error| <= hError.
+// A full-grid, stride 1, codec 0, lossless file can be loaded back as an
+// initial condition; the loader also accepts a bed elevation field 'b'.
+struct OutputOptions
+{
+    std::string filename = "Output.txt";
+    bool binary = false;
+    std::string fields = "xyuvh";
+    int roi[4] = {0, 0, -1, -1};
+    int stride = 1;
+    int codec = 0;
+    double hError = 0.;
+};
+
 class ShallowWater
 {
     // Default initialisation
@@ -19,11 +47,19 @@ class ShallowWater
     double* h = nullptr;
     double* u = nullptr;
     double* v = nullptr;
+    double* b = nullptr; // Bed elevation, only set when loaded from file
+    
+    Telemetry* telemetry = nullptr; // Optional live progress channel (not owned)
     
     void ConstructSVector(double* S);
     void GetDerivativesBLASV2(const double* S, double* dSdx, double* dSdy, const double* coeffs);
-    void GetDerivativesParallel(const int& rows, const int& cols, const double* varx, const double* vary,  double* dvardx, double* dvardy, const double* coeffs);
+    void GetDerivativesTile(const int& col0, const int& col1, const double* var, double* dvardx, double* dvardy, const double* coeffs);
+    void GetDerivativesXTile(const int& col0, const int& col1, const double* var, double* dvardx, const double* coeffs);
+    void GetDerivativesYTile(const int& col0, const int& col1, const double* vary, double* dvardy, const double* coeffs);
     void EvaluateFuncBlasV3(const int& kla, const int& kua, const int& lday, double* S, const int& ldsy, const double* coeffs, double* k, double* dSdx, double* dSdy, double* B, double* C);
+    void Diagnostics(const double* hvar, const int& inc, const int& col0, const int& col1, double& mass, double& hmax);
+    void WriteText(const OutputOptions& opts, int ix0, int iy0, int ix1, int iy1);
+    void WriteBinary(const OutputOptions& opts, int ix0, int iy0, int ix1, int iy1);
     
     
 public:
@@ -34,11 +70,15 @@ public:
     // Methods
     void sayHello();
     void SetInitialCondition();
+    bool LoadInitialCondition(const std::string& filename);
     void PrintMatrix(const int& N,  const double* A, const int& lda, const int& inc);
     void PrintVector(const int& N, const double* x, const int& inc);
     void TimeIntegrateBLAS();
     void TimeIntegrate();
+    void TimeIntegrateTasks(int ntiles);
     void WriteFile();
+    void WriteFile(const OutputOptions& opts);
+    void setTelemetry(Telemetry* tel);
     
     // 'Getter' functions
     double getTimeStep();
@@ -51,6 +91,7 @@ public:
     double* geth();
     double* getu();
     double* getv();
+    double* getb();
     
     ~ShallowWater(); // Destructor
     
@@ -0,0 +1,145 @@
+#include "Telemetry.h"
+
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <cstdio>
+#include <cmath>
+#include <limits>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// constructor definition
+Telemetry::Telemetry(){
+    mass.store(std::numeric_limits<double>::quiet_NaN());
+    hmax.store(std::numeric_limits<double>::quiet_NaN());
+}   // Default Constructor
+
+Telemetry::Telemetry(double intervalt, bool terminalt, const std::string& filePatht, const std::string& shmNamet, int diagEveryt) : diagEvery(diagEveryt), interval(intervalt), terminal(terminalt), filePath(filePatht), shmName(shmNamet){
+    mass.store(std::numeric_limits<double>::quiet_NaN());
+    hmax.store(std::numeric_limits<double>::quiet_NaN());
+}
+
+Telemetry::~Telemetry(){
+    Stop();
+    // The shared-memory object is deliberately left in place so a monitor that
+    // polls by name still sees the final 'done' record; it owns the cleanup.
+    if (shm){
+        munmap(shm, sizeof(TelemetryData));
+    }
+}   // Custom destructor definition
+
+// Method definition
+
+void Telemetry::Start(int64_t totalStepst){
+    totalSteps = totalStepst;
+    step.store(0, std::memory_order_relaxed);
+    simTime.store(0., std::memory_order_relaxed);
+
+    if (!shmName.empty() && !shm){
+        int fd = shm_open(shmName.c_str(), O_CREAT | O_RDWR, 0644);
+        if (fd >= 0 && ftruncate(fd, sizeof(TelemetryData)) == 0){
+            void* ptr = mmap(nullptr, sizeof(TelemetryData), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            if (ptr != MAP_FAILED){
+                shm = static_cast<TelemetryData*>(ptr);
+                shm->seq = 0;
+            }
+        }
+        if (fd >= 0) {close(fd);}
+        if (!shm){
+            std::cerr << "Telemetry: could not open shared memory endpoint " << shmName << std::endl;
+        }
+    }
+
+    tStart = std::chrono::steady_clock::now();
+    running.store(true);
+
+    // Reporter thread: samples the counters at a fixed wall-clock rate, so the
+    // cost of formatting and I/O never lands on the compute threads.
+    reporter = std::thread([this](){
+        TelemetryData data = {};
+        const auto period = std::chrono::duration<double>(interval);
+        const auto slice = std::chrono::milliseconds(10);
+        auto next = std::chrono::steady_clock::now() + period;
+        while (running.load(std::memory_order_relaxed)){
+            if (std::chrono::steady_clock::now() >= next){
+                Report(data, false);
+                next += std::chrono::duration_cast<std::chrono::steady_clock::duration>(period);
+            }
+            std::this_thread::sleep_for(slice);
+        }
+        Report(data, true);
+    });
+}
+
+void Telemetry::Stop(){
+    if (!reporter.joinable()) {return;}
+    running.store(false);
+    reporter.join();
+}
+
+void Telemetry::Report(TelemetryData& data, bool final){
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - tStart).count();
+
+    data.step = step.load(std::memory_order_relaxed);
+    data.totalSteps = totalSteps;
+    data.simTime = simTime.load(std::memory_order_relaxed);
+    data.stepsPerSec = (elapsed > 0.) ? data.step/elapsed : 0.;
+    data.eta = (data.stepsPerSec > 0.) ? (totalSteps - data.step)/data.stepsPerSec : std::numeric_limits<double>::infinity();
+    data.mass = mass.load(std::memory_order_relaxed);
+    data.hmax = hmax.load(std::memory_order_relaxed);
+    data.done = final ? 1 : 0;
+
+    if (terminal) {WriteTerminal(data, final);}
+    if (!filePath.empty()) {WriteFile(data);}
+    if (shm) {WriteShm(data);}
+}
+
+void Telemetry::WriteTerminal(const TelemetryData& data, bool final){
+    char line[160];
+    int len = std::snprintf(line, sizeof(line), "\rTime: %.4f. %lld time steps done out of %lld. %.1f steps/s, ETA %.1f s",
+                            data.simTime, (long long) data.step, (long long) data.totalSteps, data.stepsPerSec, std::isfinite(data.eta) ? data.eta : 0.);
+    if (!std::isnan(data.mass) && len > 0 && len < (int) sizeof(line)){
+        std::snprintf(line + len, sizeof(line) - len, ". mass %.6e, max h %.6f", data.mass, data.hmax);
+    }
+    std::cout << line << "\033[K";
+    if (final) {std::cout << std::endl;}
+    else {std::cout << std::flush;}
+}
+
+void Telemetry::WriteFile(const TelemetryData& data){
+    // Write to a temporary file and rename so a polling monitor never reads a
+    // partially written record.
+    std::string tmpPath = filePath + ".tmp";
+    std::ofstream myfile(tmpPath);
+    if (!myfile) {return;}
+    myfile << std::setprecision(16);
+    myfile << "step " << data.step << "\n";
+    myfile << "total_steps " << data.totalSteps << "\n";
+    myfile << "sim_time " << data.simTime << "\n";
+    myfile << "steps_per_sec " << data.stepsPerSec << "\n";
+    myfile << "eta " << data.eta << "\n";
+    myfile << "mass " << data.mass << "\n";
+    myfile << "hmax " << data.hmax << "\n";
+    myfile << "done " << data.done << "\n";
+    myfile.close();
+    std::rename(tmpPath.c_str(), filePath.c_str());
+}
+
+void Telemetry::WriteShm(const TelemetryData& data){
+    // Seqlock: readers retry while 'seq' is odd or changed during their copy
+    uint64_t seq = shm->seq;
+    __atomic_store_n(&shm->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    shm->step = data.step;
+    shm->totalSteps = data.totalSteps;
+    shm->simTime = data.simTime;
+    shm->stepsPerSec = data.stepsPerSec;
+    shm->eta = data.eta;
+    shm->mass = data.mass;
+    shm->hmax = data.hmax;
+    shm->done = data.done;
+    __atomic_store_n(&shm->seq, seq + 2, __ATOMIC_RELEASE);
+}
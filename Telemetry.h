@@ -0,0 +1,74 @@
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+#include <atomic>
+#include <thread>
+#include <string>
+#include <chrono>
+#include <cstdint>
+
+// Plain-old-data snapshot published by the reporter thread. The same layout is
+// mirrored into the shared-memory endpoint so an external job monitor can map
+// it directly. 'seq' is odd while the reporter is writing (seqlock).
+struct TelemetryData
+{
+    uint64_t seq;
+    int64_t step;
+    int64_t totalSteps;
+    double simTime;
+    double stepsPerSec;
+    double eta;         // Estimated wall-clock time remaining [s]
+    double mass;        // Optional diagnostics (NaN until first published)
+    double hmax;
+    int32_t done;
+};
+
+class Telemetry
+{
+    // Written by the compute threads with relaxed stores only
+    std::atomic<int64_t> step{0};
+    std::atomic<double> simTime{0.};
+    std::atomic<double> mass;
+    std::atomic<double> hmax;
+    std::atomic<bool> running{false};
+
+    int64_t totalSteps = 0;
+    int diagEvery = 0;
+    double interval = 0.5;
+    bool terminal = true;
+    std::string filePath;
+    std::string shmName;
+
+    TelemetryData* shm = nullptr;
+    std::thread reporter;
+    std::chrono::steady_clock::time_point tStart;
+
+    void Report(TelemetryData& data, bool final);
+    void WriteTerminal(const TelemetryData& data, bool final);
+    void WriteFile(const TelemetryData& data);
+    void WriteShm(const TelemetryData& data);
+
+public:
+    // Constructors
+    Telemetry(); // Default Constructor
+    Telemetry(double intervalt, bool terminalt, const std::string& filePatht, const std::string& shmNamet, int diagEveryt); // Constructor declaration
+
+    // Methods
+    void Start(int64_t totalStepst);
+    void Stop();
+
+    // Hot path: called once per time step by a single compute thread
+    inline void Publish(int64_t stept, double t){
+        step.store(stept, std::memory_order_relaxed);
+        simTime.store(t, std::memory_order_relaxed);
+    }
+    inline bool DiagnosticsDue(int64_t stept) const { return diagEvery > 0 && stept % diagEvery == 0;}
+    inline void PublishDiagnostics(double masst, double hmaxt){
+        mass.store(masst, std::memory_order_relaxed);
+        hmax.store(hmaxt, std::memory_order_relaxed);
+    }
+
+    ~Telemetry(); // Destructor
+};
+
+#endif
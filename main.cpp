@@ -3,8 +3,11 @@
 #include <boost/program_options.hpp>
 //#include <boost/timer/timer.hpp>
 #include <chrono>
+#include <cstdio>
+#include <algorithm>
 
 #include "ShallowWater.h"
+#include "Telemetry.h"
 
 namespace po = boost::program_options;
 
@@ -19,7 +22,20 @@ int main(int argc, char* argv[])
         ("Nx", po::value<int>()->default_value(100), "Number of grid points in x.")
         ("Ny", po::value<int>()->default_value(100), "Number of grid points in y.")
         ("ic", po::value<double>()->default_value(1), "Index of the initial condition to use (1-4).")
-        ("mode", po::value<int>()->default_value(2), "Analysis mode. [1] - BLAS analysis, [2] - for based analysis");
+        ("ic-file", po::value<std::string>()->default_value(""), "Binary output file (full grid, uncompressed, lossless) with h/u/v and optional bed b to start from.")
+        ("mode", po::value<int>()->default_value(2), "Analysis mode. [1] - BLAS analysis, [2] - for based analysis, [3] - task based analysis")
+        ("tiles", po::value<int>()->default_value(0), "Number of column tiles for task based analysis (0 - 4 per thread).")
+        ("progress", po::value<double>()->default_value(0.5), "Progress report interval in seconds (0 disables terminal progress).")
+        ("telemetry-file", po::value<std::string>()->default_value(""), "File rewritten with the latest telemetry at every report.")
+        ("telemetry-shm", po::value<std::string>()->default_value(""), "POSIX shared-memory object (e.g. /sw_telemetry) holding the latest telemetry. Left in place after the run; the monitor removes it (shm_unlink or rm /dev/shm/<name>).")
+        ("diag-every", po::value<int>()->default_value(0), "Compute mass and max h diagnostics every N steps (0 disables).")
+        ("output", po::value<std::string>(), "Output file name (default Output.txt, or Output.swb for binary).")
+        ("format", po::value<std::string>()->default_value("text"), "Output format: text or binary.")
+        ("fields", po::value<std::string>()->default_value("xyuvh"), "Fields to write, any of x, y, u, v, h.")
+        ("roi", po::value<std::string>()->default_value(""), "Region of interest in grid indices 'ix0,iy0,ix1,iy1' (end exclusive).")
+        ("stride", po::value<int>()->default_value(1), "Write every stride-th grid point in x and y.")
+        ("compress", po::value<std::string>()->default_value("none"), "Binary compression: none or zlib (byte-shuffle + zlib).")
+        ("h-error", po::value<double>()->default_value(0.), "Maximum absolute error when quantising h in binary output (0 is lossless).");
         
     po::variables_map vm;
     po::store(po::parse_command_line(argc, argv, opts), vm);
@@ -35,7 +51,67 @@ int main(int argc, char* argv[])
     const int Nx        = vm["Nx"].as<int>();
     const int Ny        = vm["Ny"].as<int>();
     const int ic        = vm["ic"].as<double>();
-    int analysis        = vm["mode"].as<int>();; // [1] - BLAS analysis, [2] - for based analysis
+    int analysis        = vm["mode"].as<int>();; // [1] - BLAS analysis, [2] - for based analysis, [3] - task based analysis
+    const int tiles     = vm["tiles"].as<int>();
+    const std::string icFile = vm["ic-file"].as<std::string>();
+    const double progress           = vm["progress"].as<double>();
+    const std::string telemetryFile = vm["telemetry-file"].as<std::string>();
+    const std::string telemetryShm  = vm["telemetry-shm"].as<std::string>();
+    const int diagEvery             = vm["diag-every"].as<int>();
+    
+    // Output options
+    OutputOptions out;
+    const std::string format = vm["format"].as<std::string>();
+    const std::string compress = vm["compress"].as<std::string>();
+    if (format != "text" && format != "binary"){
+        std::cout << "Invalid --format '" << format << "', expected text or binary." << std::endl;
+        return 1;
+    }
+    if (compress != "none" && compress != "zlib"){
+        std::cout << "Invalid --compress '" << compress << "', expected none or zlib." << std::endl;
+        return 1;
+    }
+    out.binary = (format == "binary");
+    out.filename = vm.count("output") ? vm["output"].as<std::string>() : (out.binary ? "Output.swb" : "Output.txt");
+    out.fields = vm["fields"].as<std::string>();
+    out.stride = vm["stride"].as<int>();
+    out.codec = (compress == "zlib") ? 1 : 0;
+    out.hError = vm["h-error"].as<double>();
+    if (!out.binary && (out.codec != 0 || out.hError != 0.)){
+        std::cout << "--compress and --h-error require --format binary." << std::endl;
+        return 1;
+    }
+    if (out.hError < 0.){
+        std::cout << "Invalid --h-error " << out.hError << ", must not be negative." << std::endl;
+        return 1;
+    }
+    if (out.fields.empty() || out.fields.find_first_not_of("xyuvh") != std::string::npos){
+        std::cout << "Invalid --fields '" << out.fields << "', expected one or more of x, y, u, v, h." << std::endl;
+        return 1;
+    }
+    if (out.binary && out.fields.find_first_of("uvh") == std::string::npos){
+        std::cout << "Binary output stores x and y in the header, --fields must include u, v or h." << std::endl;
+        return 1;
+    }
+    const std::string roi = vm["roi"].as<std::string>();
+    int roiEnd = 0;
+    if (!roi.empty() && (std::sscanf(roi.c_str(), "%d,%d,%d,%d%n", &out.roi[0], &out.roi[1], &out.roi[2], &out.roi[3], &roiEnd) != 4 || roi[roiEnd] != '\0')){
+        std::cout << "Invalid --roi '" << roi << "', expected ix0,iy0,ix1,iy1." << std::endl;
+        return 1;
+    }
+    if (out.stride < 1){
+        std::cout << "Invalid --stride " << out.stride << ", must be at least 1." << std::endl;
+        return 1;
+    }
+    // Same clamping as WriteFile, checked here so a bad region fails before the run
+    const int roiX0 = std::max(out.roi[0], 0);
+    const int roiY0 = std::max(out.roi[1], 0);
+    const int roiX1 = (out.roi[2] < 0) ? Nx : std::min(out.roi[2], Nx);
+    const int roiY1 = (out.roi[3] < 0) ? Ny : std::min(out.roi[3], Ny);
+    if (roiX1 <= roiX0 || roiY1 <= roiY0){
+        std::cout << "Invalid --roi '" << roi << "', region is empty on the " << Nx << "x" << Ny << " grid." << std::endl;
+        return 1;
+    }
     
     // Fixed parameters
     double dx = 1.;
@@ -50,10 +126,24 @@ int main(int argc, char* argv[])
     std::cout << "\t" << "Number of grid points in y:\t" << sol1.getNy() << std::endl;
     std::cout << "\t" << "Spatial step in x:\t" << "\t" <<  dx << std::endl;
     std::cout << "\t" << "Spatial step in y:\t" << "\t" <<  dy << std::endl;
-    std::cout << "\t" << "Initial condition index:\t" << sol1.getIc() << std::endl;
+    if (icFile.empty()){
+        std::cout << "\t" << "Initial condition index:\t" << sol1.getIc() << std::endl;
+        sol1.SetInitialCondition(); 
+    }
+    else{
+        std::cout << "\t" << "Initial condition file:\t" << "\t" << icFile << std::endl;
+        if (!sol1.LoadInitialCondition(icFile)){
+            return 1;
+        }
+    }
     
-    sol1.SetInitialCondition(); 
+    // Live progress is reported from a separate thread at a fixed wall-clock rate
+    Telemetry telemetry(progress > 0 ? progress : 0.5, progress > 0, telemetryFile, telemetryShm, diagEvery);
+    if (progress > 0 || !telemetryFile.empty() || !telemetryShm.empty()){
+        sol1.setTelemetry(&telemetry);
+    }
     
+    auto tStart = std::chrono::steady_clock::now();
     if (analysis == 1){
         std::cout << "\t" << "Implemenatation mode:\t\tBLAS\n" << std::endl;
         sol1.TimeIntegrateBLAS();    
@@ -63,8 +153,13 @@ int main(int argc, char* argv[])
 //        sol1.TimeIntegrateForLoop();
         sol1.TimeIntegrate();
     }
+    else if (analysis == 3){
+        std::cout << "\t" << "Implemenatation mode:\t\t" << "TASK DATAFLOW" << std::endl;
+        sol1.TimeIntegrateTasks(tiles);
+    }
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - tStart).count();
     
-    sol1.WriteFile();
+    sol1.WriteFile(out);
     
     int y1 = 88;
     int x1 = 26;
@@ -72,6 +167,7 @@ int main(int argc, char* argv[])
     int x2 = 21;
     
     std::cout << "\nSIMUALTION RESULTS:" << std::endl;
+    std::cout << "\t" << std::setprecision (4) << std::fixed << "Integration time [s]:\t" << elapsed << "\t(" << std::lround(T/dt)/elapsed << " steps/s)" << std::endl;
     std::cout << "\t" << std::setprecision (16) << std::fixed << "h[" << y1 << "," << x1 << "] = " << "\t" <<*(sol1.geth() + y1 +Ny*(x1)) << std::endl;
     std::cout << "\t" << std::setprecision (16) << std::fixed << "h[" << y2 << "," << x2 << "] = " << "\t" <<*(sol1.geth() + y2 +Ny*x2) << std::endl;
     